@@ -1,4 +1,4 @@
-import requests, time, sqlite3, json, sys
+import requests, time, sqlite3, json, sys, re, struct, unicodedata
 from calendar import monthrange
 from pathlib import Path
 
@@ -26,7 +26,7 @@ def get_facts_from_day(i_day, i_month, con, cur):
                             pages_raw = facts[i].get("pages")
                             pages = [
                                 {
-                                    "title": page.get("title"),
+                                    "title": strip_title(page.get("title")),
                                     "thumb": page.get("thumbnail").get("source") if page.get("thumbnail") else "",
                                     "thumb_w": page.get("thumbnail").get("width") if page.get("thumbnail") else 0,
                                     "thumb_h": page.get("thumbnail").get("height") if page.get("thumbnail") else 0,
@@ -34,13 +34,15 @@ def get_facts_from_day(i_day, i_month, con, cur):
                                 }
                                 for page in pages_raw
                             ]
+                            for page in pages:
+                                page["title_w"] = display_width(page["title"])
                             (thumb, thumb_w, thumb_h) = get_thumbnail(text, pages)
-                            facts[i] = (text, key, thumb, thumb_w, thumb_h, day, month, year, json.dumps(pages))
+                            facts[i] = (text, key, thumb, thumb_w, thumb_h, day, month, year, json.dumps(pages), get_words(text))
 
                     facts = data["selected"] + data["births"] + data["deaths"] + data["events"] + data["holidays"]
                     print(f"\033[32m[{day:02}/{month:02} OK] ->\033[37m Fetched {len(facts)} facts.")
 
-                    cur.executemany("INSERT INTO Facts VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)", facts)
+                    cur.executemany("INSERT INTO Facts VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)", facts)
                     con.commit()
                 else:
                     message = response.text.strip()
@@ -58,6 +60,50 @@ def get_facts_from_day(i_day, i_month, con, cur):
                 print(f"[REQUESTS ERROR]: {e}.\nRetrying...")
                 return get_facts_from_day(day, month, con, cur)
                 
+def strip_title(title):
+    return (title or "").replace("_", " ")
+
+def display_width(s):
+    width = 0
+    for c in s:
+        # Combining marks and format characters don't take a cell
+        if unicodedata.combining(c) or unicodedata.category(c) in ("Mn", "Me", "Cf"):
+            continue
+        width += 2 if unicodedata.east_asian_width(c) in ("W", "F") else 1
+    return width
+
+def get_words(text):
+    # Packs every word as (byte offset, byte length, display width) int32 triples,
+    # so the C program can wrap the text without scanning it.
+    words = []
+    byte_offset = 0
+    last = 0
+    for m in re.finditer(r"[^ \n]+", text):
+        byte_offset += len(text[last:m.start()].encode())
+        word = m.group()
+        length = len(word.encode())
+        words += [byte_offset, length, display_width(word)]
+        byte_offset += length
+        last = m.end()
+    return struct.pack(f"<{len(words)}i", *words)
+
+def has_words_column(cur):
+    return "words" in [row[1] for row in cur.execute("PRAGMA table_info(Facts)")]
+
+def migrate(con, cur):
+    if not has_words_column(cur):
+        cur.execute("ALTER TABLE Facts ADD COLUMN words BLOB")
+
+    rows = cur.execute("SELECT rowid, text, pages FROM Facts").fetchall()
+    for (rowid, text, pages_raw) in rows:
+        pages = json.loads(pages_raw) if pages_raw else []
+        for page in pages:
+            page["title"] = strip_title(page.get("title"))
+            page["title_w"] = display_width(page["title"])
+        cur.execute("UPDATE Facts SET words = ?, pages = ? WHERE rowid = ?", (get_words(text), json.dumps(pages), rowid))
+    con.commit()
+    print(f"\033[32m[MIGRATION OK] ->\033[37m Updated {len(rows)} facts.")
+
 def get_thumbnail(text, pages):
     if len(pages) == 0:
         return None, 0, 0
@@ -90,6 +136,18 @@ if __name__ == "__main__":
     i_day = 1 # 1st
     i_month = 1 # January
 
+    resolved_db_path = Path(DB_PATH).resolve()
+
+    # Use `python get-facts.py --migrate` to add the precomputed layout data to an existing database
+    if len(sys.argv) > 1 and sys.argv[1] == "--migrate":
+        if not resolved_db_path.is_file():
+            print(f"Error: {resolved_db_path} does not exist.")
+            sys.exit(1)
+        con = sqlite3.connect(resolved_db_path)
+        migrate(con, con.cursor())
+        con.close()
+        sys.exit(0)
+
     # Use `python scraper.py <day> <month>` to start fetching from a specific date
     if len(sys.argv) > 1:
         if d := sys.argv[1]:
@@ -97,8 +155,6 @@ if __name__ == "__main__":
         if m := sys.argv[2]:
             i_month = int(m) if int(m) >= 1 and int(m) <= 12 else 1
 
-    resolved_db_path = Path(DB_PATH).resolve()
-
     # Delete DB if we're not resuming the process
     if i_day == 1 and i_month == 1 and resolved_db_path.is_file():
         try:
@@ -120,10 +176,15 @@ if __name__ == "__main__":
             day INT NOT NULL, 
             month INT NOT NULL, 
             year INT, 
-            pages TEXT
+            pages TEXT,
+            words BLOB
         )
     """)
 
+    # Resuming on a database created by an older version
+    if not has_words_column(cur):
+        migrate(con, cur)
+
     print("Downloading...")
     get_facts_from_day(i_day, i_month, con, cur)
 
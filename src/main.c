@@ -5,11 +5,14 @@
 #include <asm-generic/ioctls.h>
 #include <chafa/chafa.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <glib-2.0/glib.h>
 #include <libgen.h>
 #include <limits.h>
 #include <linux/limits.h>
+#include <poll.h>
 #include <sqlite3.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -17,6 +20,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 #define STB_IMAGE_IMPLEMENTATION
@@ -28,9 +33,22 @@
 #define IMAGE_TEMP_FILE "/tmp/shell-facts-XXXXXX"
 #define MAX_IMAGE_WIDTH 30
 #define MAX_IMAGE_HEIGHT 10
+#define IMAGE_CACHE_DIR "shell-facts"
+#define IMAGE_CACHE_MAX_SIZE (32 * 1024 * 1024)
+#define KITTY_SESSION_FILE "shell-facts-kitty"
+#define KITTY_RESPONSE_TIMEOUT 3 // In seconds
+
+// Precomputed by get-facts.py, see `get_words()`.
+typedef struct {
+    int32_t offset; // In bytes, into `Fact.text`
+    int32_t length; // In bytes
+    int32_t width;  // In terminal cells
+} FactWord;
 
 typedef struct {
     char *text;
+    FactWord *words;
+    size_t word_c;
     char *thumb;
     int t_width;
     int t_height;
@@ -45,6 +63,12 @@ typedef struct {
     gint width_pixels, height_pixels;
 } TermSize;
 
+typedef struct {
+    ChafaPixelMode pixel_mode;
+    ChafaPassthrough passthrough;
+    gint cell_width, cell_height; // Size of each character cell in pixels.
+} RenderConfig;
+
 typedef struct {
     uint8_t output_raw;
     uint8_t render_image;
@@ -69,9 +93,9 @@ char *resolve_db_path() {
 }
 
 void strip_title(char *title) {
-    for (size_t i = 0; i < strlen(title); i++) {
-        if (title[i] == '_')
-            title[i] = ' ';
+    for (char *p = title; *p; p++) {
+        if (*p == '_')
+            *p = ' ';
     }
 }
 
@@ -236,9 +260,20 @@ Fact query_data(CmdOptions options, char *type, int day, int month) {
     }
 
     sqlite3_stmt *stmt;
-    const char *sql = "SELECT text, thumb, thumb_w, thumb_h, year, pages FROM Facts WHERE type LIKE "
-                      "? AND day LIKE ? AND month LIKE "
-                      "? ORDER BY RANDOM() LIMIT 1;";
+    // Databases created before the layout data was added don't have the `words` column.
+    uint8_t has_words = 0;
+    rc = sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info('Facts') WHERE name = 'words';", -1, &stmt, 0);
+    if (rc == SQLITE_OK) {
+        has_words = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+    }
+
+    const char *sql = has_words ? "SELECT text, thumb, thumb_w, thumb_h, year, pages, words FROM Facts WHERE type LIKE "
+                                  "? AND day LIKE ? AND month LIKE "
+                                  "? ORDER BY RANDOM() LIMIT 1;"
+                                : "SELECT text, thumb, thumb_w, thumb_h, year, pages, NULL AS words FROM Facts WHERE type LIKE "
+                                  "? AND day LIKE ? AND month LIKE "
+                                  "? ORDER BY RANDOM() LIMIT 1;";
 
     rc = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
     if (rc != SQLITE_OK) {
@@ -252,6 +287,8 @@ Fact query_data(CmdOptions options, char *type, int day, int month) {
 
     Fact fact = {
         .text = NULL,
+        .words = NULL,
+        .word_c = 0,
         .thumb = NULL,
         .t_width = 0,
         .t_height = 0,
@@ -275,6 +312,30 @@ Fact query_data(CmdOptions options, char *type, int day, int month) {
         if (fact.pages == NULL) {
             fprintf(stderr, "[ERROR]: Failed to parse pages: %s\n", cJSON_GetErrorPtr());
         }
+        // get-facts.py packs the words as little-endian int32, which is what we run on. No byte swapping here.
+        const void *words = sqlite3_column_blob(stmt, 6);
+        size_t words_size = sqlite3_column_bytes(stmt, 6);
+        fact.word_c = words_size / sizeof(FactWord);
+        if (words != NULL && fact.word_c > 0 && words_size % sizeof(FactWord) == 0) {
+            fact.words = malloc(fact.word_c * sizeof(FactWord));
+            memcpy(fact.words, words, fact.word_c * sizeof(FactWord));
+
+            // The words are printed straight from these offsets, so a blob that doesn't match the text is dropped.
+            size_t text_len = strlen(fact.text);
+            for (size_t i = 0; i < fact.word_c; i++) {
+                FactWord word = fact.words[i];
+                if (word.offset < 0 || word.length < 0 || word.width < 0 || (size_t)word.offset + word.length > text_len) {
+                    free(fact.words);
+                    fact.words = NULL;
+                    break;
+                }
+            }
+        }
+        if (fact.words == NULL) {
+            fact.word_c = 0;
+            if (*fact.text && !options.output_raw)
+                fprintf(stderr, "[WARNING]: Missing layout data for this fact. Run `python get-facts.py --migrate` to update the database.\n");
+        }
     } else {
         fprintf(stderr, "No facts today :/.\n");
         sqlite3_close(db);
@@ -286,16 +347,28 @@ Fact query_data(CmdOptions options, char *type, int day, int month) {
     return fact;
 }
 
-uint8_t chafa_render_image(unsigned char *pixels, int img_width, int img_height, ChafaTermInfo *term_info, TermSize term_size, gint *width_cells_out, gint *height_cells_out) {
+RenderConfig get_render_config(ChafaTermInfo *term_info, TermSize term_size) {
+    RenderConfig config = {
+        .cell_width = -1,
+        .cell_height = -1,
+    };
+    config.pixel_mode = chafa_term_info_get_best_pixel_mode(term_info);
+    config.passthrough = chafa_term_info_get_is_pixel_passthrough_needed(term_info, config.pixel_mode) ? chafa_term_info_get_passthrough_type(term_info) : CHAFA_PASSTHROUGH_NONE;
+
+    if (term_size.width_cells > 0 && term_size.height_cells > 0 && term_size.width_pixels > 0 && term_size.height_pixels > 0) {
+        config.cell_width = term_size.width_pixels / term_size.width_cells;
+        config.cell_height = term_size.height_pixels / term_size.height_cells;
+    }
+    return config;
+}
+
+GString *chafa_render_image(unsigned char *pixels, int img_width, int img_height, ChafaTermInfo *term_info, RenderConfig render_config, gint *width_cells_out, gint *height_cells_out) {
     // https://github.com/hpjansson/chafa/blob/caafc58b2348032bc57d8b5f1af24905a414cb52/examples/adaptive.c
     gfloat font_ratio = 0.5;
-    gint cell_width = -1, cell_height = -1; // Size of each character cell in pixels.
-    gint width_cells, height_cells;         // Size of output image in cells;
+    gint width_cells, height_cells; // Size of output image in cells;
 
-    if (term_size.width_cells > 0 && term_size.height_cells > 0 && term_size.width_pixels > 0 && term_size.height_pixels > 0) {
-        cell_width = term_size.width_pixels / term_size.width_cells;
-        cell_height = term_size.height_pixels / term_size.height_cells;
-        font_ratio = (gdouble)cell_width / (gdouble)cell_height;
+    if (render_config.cell_width > 0 && render_config.cell_height > 0) {
+        font_ratio = (gdouble)render_config.cell_width / (gdouble)render_config.cell_height;
     }
     width_cells = MAX_IMAGE_WIDTH;
     height_cells = MAX_IMAGE_HEIGHT;
@@ -303,37 +376,24 @@ uint8_t chafa_render_image(unsigned char *pixels, int img_width, int img_height,
     chafa_calc_canvas_geometry(img_width, img_height, &width_cells, &height_cells, font_ratio, FALSE, FALSE);
 
     ChafaCanvasMode mode = chafa_term_info_get_best_canvas_mode(term_info);
-    ChafaPixelMode pixel_mode = chafa_term_info_get_best_pixel_mode(term_info);
-    // Don't render symbols. They work differently.
-    if (pixel_mode == 0) {
-        return 0;
-    }
-    ChafaPassthrough passthrough = chafa_term_info_get_is_pixel_passthrough_needed(term_info, pixel_mode) ? chafa_term_info_get_passthrough_type(term_info) : CHAFA_PASSTHROUGH_NONE;
 
     ChafaCanvasConfig *config = chafa_canvas_config_new();
     chafa_canvas_config_set_canvas_mode(config, mode);
-    chafa_canvas_config_set_pixel_mode(config, pixel_mode);
+    chafa_canvas_config_set_pixel_mode(config, render_config.pixel_mode);
     chafa_canvas_config_set_geometry(config, width_cells, height_cells);
-    chafa_canvas_config_set_passthrough(config, passthrough);
+    chafa_canvas_config_set_passthrough(config, render_config.passthrough);
 
-    if (cell_width > 0 && cell_height > 0) {
+    if (render_config.cell_width > 0 && render_config.cell_height > 0) {
         /* We know the pixel dimensions of each cell. Store it in the config. */
-        chafa_canvas_config_set_cell_geometry(config, cell_width, cell_height);
+        chafa_canvas_config_set_cell_geometry(config, render_config.cell_width, render_config.cell_height);
     }
     ChafaCanvas *canvas = chafa_canvas_new(config);
     chafa_canvas_draw_all_pixels(canvas, CHAFA_PIXEL_RGBA8_UNASSOCIATED, pixels, img_width, img_height, img_width * 4);
 
     GString *printable = chafa_canvas_print(canvas, term_info);
-    uint8_t rendered = 0;
     if (printable != NULL) {
-        fwrite(printable->str, sizeof(char), printable->len, stdout);
-        fputc('\n', stdout);
-        g_string_free(printable, TRUE);
-
         *width_cells_out = width_cells;
         *height_cells_out = height_cells;
-
-        rendered = 1;
     } else {
         fprintf(stderr, "Failed to render image file!\n");
 
@@ -343,19 +403,313 @@ uint8_t chafa_render_image(unsigned char *pixels, int img_width, int img_height,
     chafa_canvas_unref(canvas);
     chafa_canvas_config_unref(config);
 
-    return rendered;
+    return printable;
 }
 
-uint8_t render_thumb(char *thumb, ChafaTermInfo *term_info, TermSize term_size, gint *width_cells_out, gint *height_cells_out) {
-    if (MAX_IMAGE_WIDTH * 3 > term_size.width_cells || MAX_IMAGE_HEIGHT + 5 > term_size.height_cells)
+guint32 hash_url(const char *url) {
+    // FNV-1a
+    guint32 hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)url; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+guint32 kitty_image_id(const char *url) {
+    // Kitty reserves id 0 for "no id".
+    guint32 id = hash_url(url);
+    return id ? id : 1;
+}
+
+char *kitty_session_path() {
+    // Only XDG_RUNTIME_DIR is guaranteed to be cleared on logout and reboot. GLib falls back to ~/.cache, which isn't.
+    const char *runtime_dir = g_getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir == NULL || *runtime_dir == '\0')
+        return NULL;
+
+    // Session ids get reused, so identify the session by its leader's start time and the boot id as well.
+    int sid = (int)getsid(0);
+    unsigned long long start_time = 0;
+    gchar *stat_path = g_strdup_printf("/proc/%d/stat", sid);
+    gchar *stat;
+    if (g_file_get_contents(stat_path, &stat, NULL, NULL)) {
+        // `starttime` is field 22. `comm` (field 2) may contain spaces, so skip past its closing parenthesis.
+        char *fields = strrchr(stat, ')');
+        if (fields != NULL)
+            sscanf(fields + 1, " %*c %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %llu", &start_time);
+        g_free(stat);
+    }
+    g_free(stat_path);
+
+    gchar *boot_id;
+    if (start_time == 0 || !g_file_get_contents("/proc/sys/kernel/random/boot_id", &boot_id, NULL, NULL))
+        return NULL;
+    g_strstrip(boot_id);
+
+    const char *window = g_getenv("KITTY_WINDOW_ID");
+    gchar *name = g_strdup_printf(KITTY_SESSION_FILE "-%s-%d-%llu-%s", boot_id, sid, start_time, window ? window : "0");
+    char *path = g_build_filename(runtime_dir, name, NULL);
+    g_free(name);
+    g_free(boot_id);
+    return path;
+}
+
+uint8_t kitty_session_lookup(const char *session_path, const char *thumb, guint32 id, gint *width_cells_out, gint *height_cells_out) {
+    FILE *f = fopen(session_path, "r");
+    if (f == NULL)
         return 0;
 
+    // Each line: `<id> <width_cells> <height_cells> <url>`. Compare the url too, ids are only a hash of it.
+    char *line = NULL;
+    size_t line_size = 0;
+    uint8_t found = 0;
+    while (getline(&line, &line_size, f) != -1) {
+        guint32 r_id;
+        gint width_cells, height_cells;
+        int url_start;
+        if (sscanf(line, "%x %d %d %n", &r_id, &width_cells, &height_cells, &url_start) != 3)
+            continue;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (r_id == id && strcmp(line + url_start, thumb) == 0 && width_cells > 0 && height_cells > 0) {
+            *width_cells_out = width_cells;
+            *height_cells_out = height_cells;
+            found = 1;
+            break;
+        }
+    }
+    free(line);
+    fclose(f);
+    return found;
+}
+
+void kitty_session_record(const char *session_path, const char *thumb, guint32 id, gint width_cells, gint height_cells) {
+    FILE *f = fopen(session_path, "a");
+    if (f == NULL)
+        return;
+
+    fprintf(f, "%08x %d %d %s\n", id, width_cells, height_cells, thumb);
+    fclose(f);
+}
+
+GString *kitty_assign_image_id(GString *printable, guint32 id) {
+    // Chafa transmits kitty images with `a=T` and no id. Tag the first chunk so we can place it again later.
+    // `q=2` silences the terminal's responses, otherwise they would end up in the shell's input.
+    char *transmit = strstr(printable->str, "\033_Ga=T,");
+    if (transmit == NULL)
+        return NULL;
+
+    gchar *tag = g_strdup_printf("i=%u,q=2,", id);
+    g_string_insert(printable, transmit - printable->str + 3, tag);
+    g_free(tag);
+    return printable;
+}
+
+uint8_t kitty_place_image(guint32 id, gint width_cells, gint height_cells) {
+    // The terminal may have dropped the image (e.g. after `reset`), so we ask for its response
+    // and only skip the upload if the placement succeeded.
+    int tty = open("/dev/tty", O_RDWR | O_NOCTTY);
+    if (tty == -1)
+        return 0;
+
+    struct termios saved, raw;
+    if (tcgetattr(tty, &saved) != 0) {
+        close(tty);
+        return 0;
+    }
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(tty, TCSANOW, &raw);
+
+    // Same cell geometry as the original transmission, so the cursor ends up in the same place.
+    // Terminals answer in order, so the reply to the device attributes query (`\e[c`) tells us
+    // the placement reply, if any, has already arrived. Over SSH that can take a while.
+    printf("\033_Ga=p,i=%u,c=%d,r=%d\033\\\033[c", id, width_cells, height_cells);
+    fflush(stdout);
+
+    gchar *ok = g_strdup_printf("\033_Gi=%u;OK\033\\", id);
+    uint8_t placed = 0;
+    GString *seq = g_string_new(NULL);  // Escape sequence being read
+    GString *typed = g_string_new(NULL); // Anything else is user input
+    gint64 deadline = g_get_monotonic_time() + KITTY_RESPONSE_TIMEOUT * G_USEC_PER_SEC;
+
+    for (;;) {
+        // Last resort, in case the terminal never answers.
+        gint64 remaining = (deadline - g_get_monotonic_time()) / 1000;
+        struct pollfd pfd = {.fd = tty, .events = POLLIN};
+        char c;
+        if (remaining <= 0 || poll(&pfd, 1, remaining) <= 0 || read(tty, &c, 1) != 1)
+            break;
+
+        if (seq->len == 0 && c != '\033') {
+            g_string_append_c(typed, c);
+            continue;
+        }
+        g_string_append_c(seq, c);
+        if (seq->len < 2)
+            continue;
+
+        if (seq->str[1] == '_') {
+            // APC, ends with ST (`\e\`)
+            if (seq->len > 2 && seq->str[seq->len - 2] == '\033' && c == '\\') {
+                if (strcmp(seq->str, ok) == 0)
+                    placed = 1;
+                g_string_truncate(seq, 0);
+            }
+        } else if (seq->str[1] == '[') {
+            // CSI. The device attributes reply (`\e[?...c`) is our terminator, anything else was typed.
+            if (seq->len > 2 && c >= 0x40 && c <= 0x7E) {
+                if (seq->str[2] == '?' && c == 'c')
+                    break;
+                g_string_append_len(typed, seq->str, seq->len);
+                g_string_truncate(seq, 0);
+            }
+        } else {
+            g_string_append_len(typed, seq->str, seq->len);
+            g_string_truncate(seq, 0);
+        }
+    }
+
+    tcsetattr(tty, TCSANOW, &saved);
+    // Give back whatever the user typed while we were waiting.
+    for (gsize i = 0; i < typed->len; i++)
+        ioctl(tty, TIOCSTI, &typed->str[i]);
+    close(tty);
+
+    g_string_free(seq, TRUE);
+    g_string_free(typed, TRUE);
+    g_free(ok);
+    return placed;
+}
+
+char *image_cache_dir() {
+    char *dir = g_build_filename(g_get_user_cache_dir(), IMAGE_CACHE_DIR, NULL);
+    if (g_mkdir_with_parents(dir, 0700) != 0) {
+        g_free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+char *image_cache_path(const char *thumb, RenderConfig render_config) {
+    char *dir = image_cache_dir();
+    if (dir == NULL)
+        return NULL;
+
+    // The encoded payload depends on everything that goes into the canvas config, not only the url.
+    gchar *name = g_strdup_printf("%08x-%d-%d-%dx%d", hash_url(thumb), render_config.pixel_mode, render_config.passthrough, render_config.cell_width, render_config.cell_height);
+    char *path = g_build_filename(dir, name, NULL);
+    g_free(name);
+    g_free(dir);
+    return path;
+}
+
+GString *image_cache_load(const char *path, const char *thumb, gint *width_cells_out, gint *height_cells_out) {
+    gchar *contents;
+    gsize len;
+    if (path == NULL || !g_file_get_contents(path, &contents, &len, NULL))
+        return NULL;
+
+    // Header line: `<width_cells> <height_cells> <url>`, followed by the payload as printed by chafa.
+    // File names are only a hash of the url, so make sure it's the same one.
+    gint width_cells, height_cells;
+    int url_start;
+    char *payload = memchr(contents, '\n', len);
+    if (payload == NULL || sscanf(contents, "%d %d %n", &width_cells, &height_cells, &url_start) != 2 || width_cells <= 0 || height_cells <= 0 ||
+        payload - (contents + url_start) != (ptrdiff_t)strlen(thumb) || memcmp(contents + url_start, thumb, strlen(thumb)) != 0) {
+        g_free(contents);
+        return NULL;
+    }
+    payload++;
+    GString *printable = g_string_new_len(payload, len - (payload - contents));
+    g_free(contents);
+
+    // Keep recently shown thumbnails from being pruned.
+    utimes(path, NULL);
+
+    *width_cells_out = width_cells;
+    *height_cells_out = height_cells;
+    return printable;
+}
+
+typedef struct {
+    char *path;
+    off_t size;
+    time_t mtime;
+} CacheEntry;
+
+int compare_cache_entries(const void *a, const void *b) {
+    time_t mtime_a = ((const CacheEntry *)a)->mtime;
+    time_t mtime_b = ((const CacheEntry *)b)->mtime;
+    return (mtime_a > mtime_b) - (mtime_a < mtime_b);
+}
+
+void image_cache_prune() {
+    char *dir_path = image_cache_dir();
+    if (dir_path == NULL)
+        return;
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        g_free(dir_path);
+        return;
+    }
+
+    CacheEntry *entries = NULL;
+    size_t entry_c = 0, entry_cap = 0;
+    off_t total_size = 0;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        struct stat st;
+        char *path = g_build_filename(dir_path, dirent->d_name, NULL);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            g_free(path);
+            continue;
+        }
+        if (entry_c == entry_cap) {
+            entry_cap = entry_cap ? entry_cap * 2 : 64;
+            entries = realloc(entries, entry_cap * sizeof(CacheEntry));
+        }
+        entries[entry_c++] = (CacheEntry){.path = path, .size = st.st_size, .mtime = st.st_mtime};
+        total_size += st.st_size;
+    }
+    closedir(dir);
+
+    // Least recently shown first
+    if (total_size > IMAGE_CACHE_MAX_SIZE)
+        qsort(entries, entry_c, sizeof(CacheEntry), compare_cache_entries);
+
+    for (size_t i = 0; i < entry_c; i++) {
+        if (total_size > IMAGE_CACHE_MAX_SIZE && unlink(entries[i].path) == 0)
+            total_size -= entries[i].size;
+        g_free(entries[i].path);
+    }
+    free(entries);
+    g_free(dir_path);
+}
+
+void image_cache_store(const char *path, const char *thumb, GString *printable, gint width_cells, gint height_cells) {
+    if (path == NULL)
+        return;
+
+    GString *contents = g_string_new(NULL);
+    g_string_printf(contents, "%d %d %s\n", width_cells, height_cells, thumb);
+    g_string_append_len(contents, printable->str, printable->len);
+    g_file_set_contents(path, contents->str, contents->len, NULL);
+    g_string_free(contents, TRUE);
+
+    image_cache_prune();
+}
+
+GString *download_and_render_thumb(char *thumb, ChafaTermInfo *term_info, RenderConfig render_config, gint *width_cells_out, gint *height_cells_out) {
     // Save temp file
     char image_temp_file[256] = IMAGE_TEMP_FILE;
     int fd = mkstemp(image_temp_file);
     if (fd == -1) {
         fprintf(stderr, "Failed to create temp file!\n");
-        return 0;
+        return NULL;
     }
     close(fd);
 
@@ -364,7 +718,7 @@ uint8_t render_thumb(char *thumb, ChafaTermInfo *term_info, TermSize term_size,
     if (system(cmd) != 0) {
         fprintf(stderr, "Failed to download image file!\n");
         unlink(image_temp_file);
-        return 0;
+        return NULL;
     }
 
     // Load image.
@@ -373,20 +727,80 @@ uint8_t render_thumb(char *thumb, ChafaTermInfo *term_info, TermSize term_size,
     if (pixels == NULL) {
         fprintf(stderr, "Failed to load image file!\n");
         unlink(image_temp_file);
-        return 0;
+        return NULL;
     }
 
     // Render image
+    GString *printable = chafa_render_image(pixels, img_width, img_height, term_info, render_config, width_cells_out, height_cells_out);
+
+    stbi_image_free(pixels);
+    unlink(image_temp_file);
+
+    return printable;
+}
+
+uint8_t render_thumb(char *thumb, ChafaTermInfo *term_info, TermSize term_size, gint *width_cells_out, gint *height_cells_out) {
+    if (MAX_IMAGE_WIDTH * 3 > term_size.width_cells || MAX_IMAGE_HEIGHT + 5 > term_size.height_cells)
+        return 0;
+
+    RenderConfig render_config = get_render_config(term_info, term_size);
+    // Don't render symbols. They work differently.
+    if (render_config.pixel_mode == CHAFA_PIXEL_MODE_SYMBOLS)
+        return 0;
+
     gint width_cells, height_cells;
-    uint8_t rendered = chafa_render_image(pixels, img_width, img_height, term_info, term_size, &width_cells, &height_cells);
+    GString *printable = NULL;
+    char *cache_path = NULL;
+    char *session_path = NULL;
+
+    // Kitty keeps uploaded images around, so we only send each thumbnail once per session and place it by id afterwards.
+    // Passthrough (tmux, screen) wraps the sequences differently, so it goes through the disk cache instead.
+    guint32 kitty_id = 0;
+    if (render_config.pixel_mode == CHAFA_PIXEL_MODE_KITTY && render_config.passthrough == CHAFA_PASSTHROUGH_NONE)
+        session_path = kitty_session_path();
+
+    if (session_path != NULL) {
+        kitty_id = kitty_image_id(thumb);
+        if (kitty_session_lookup(session_path, thumb, kitty_id, &width_cells, &height_cells) &&
+            kitty_place_image(kitty_id, width_cells, height_cells)) {
+            fputc('\n', stdout);
+            g_free(session_path);
+
+            *width_cells_out = width_cells;
+            *height_cells_out = height_cells;
+            return 1;
+        }
+    } else {
+        cache_path = image_cache_path(thumb, render_config);
+        printable = image_cache_load(cache_path, thumb, &width_cells, &height_cells);
+    }
+
+    if (printable == NULL) {
+        printable = download_and_render_thumb(thumb, term_info, render_config, &width_cells, &height_cells);
+        if (printable == NULL) {
+            g_free(cache_path);
+            g_free(session_path);
+            return 0;
+        }
+
+        if (session_path != NULL) {
+            if (kitty_assign_image_id(printable, kitty_id) != NULL)
+                kitty_session_record(session_path, thumb, kitty_id, width_cells, height_cells);
+        } else {
+            image_cache_store(cache_path, thumb, printable, width_cells, height_cells);
+        }
+    }
+
+    fwrite(printable->str, sizeof(char), printable->len, stdout);
+    fputc('\n', stdout);
+    g_string_free(printable, TRUE);
+    g_free(cache_path);
+    g_free(session_path);
 
     *width_cells_out = width_cells;
     *height_cells_out = height_cells;
 
-    stbi_image_free(pixels);
-    unlink(image_temp_file);
-
-    return rendered;
+    return 1;
 }
 
 char *number_to_ordinal(int n) {
@@ -403,6 +817,43 @@ char *number_to_ordinal(int n) {
     return s;
 }
 
+size_t wrap_text_by_words(Fact fact, size_t initial_col, TermSize term_size) {
+    // Without layout data there's nothing to wrap with. `main` doesn't render the image in that case.
+    if (fact.words == NULL) {
+        printf("%s", fact.text);
+        return 1;
+    }
+
+    // Text starts at `initial_col + 1`. When it's 0, we're not next to an image and can simply break the line.
+    // Unknown terminal width (e.g. not a tty): don't wrap at all.
+    uint8_t wrap = term_size.width_cells > 0;
+    long max_cols = (long)term_size.width_cells - (long)initial_col;
+    long row_c = 0;
+    size_t lines = 1;
+
+    for (size_t i = 0; i < fact.word_c; i++) {
+        FactWord word = fact.words[i];
+        if (wrap && row_c > 0 && row_c + 1 + word.width > max_cols) {
+            if (initial_col > 0) {
+                // Move cursor to the next row
+                printf("\033[1B");
+                // Move cursor right
+                printf("\033[%zuG", initial_col + 1);
+            } else {
+                putchar('\n');
+            }
+            row_c = 0;
+            lines++;
+        } else if (row_c > 0) {
+            putchar(' ');
+            row_c++;
+        }
+        fwrite(fact.text + word.offset, sizeof(char), word.length, stdout);
+        row_c += word.width;
+    }
+    return lines;
+}
+
 size_t wrap_pages_by_words(cJSON *pages, DS_SB_StringBuffer **sb_out, size_t initial_col, TermSize term_size) {
     cJSON *page;
     size_t i = 0;
@@ -414,13 +865,21 @@ size_t wrap_pages_by_words(cJSON *pages, DS_SB_StringBuffer **sb_out, size_t ini
             lines = 1;
         }
         cJSON *t_title = cJSON_GetObjectItemCaseSensitive(page, "title");
+        cJSON *t_title_w = cJSON_GetObjectItemCaseSensitive(page, "title_w");
         cJSON *url = cJSON_GetObjectItemCaseSensitive(page, "url");
         if (cJSON_IsString(t_title) && *t_title->valuestring &&
             cJSON_IsString(url) && *url->valuestring) {
             char *title = t_title->valuestring;
-            strip_title(title);
+            size_t title_w;
+            if (cJSON_IsNumber(t_title_w) && t_title_w->valueint >= 0) {
+                title_w = t_title_w->valueint;
+            } else {
+                // Not migrated yet
+                strip_title(title);
+                title_w = strlen(title);
+            }
 
-            if (initial_col + 5 + row_c + strlen(title) + 3 >= term_size.width_cells) {
+            if (initial_col + 5 + row_c + title_w + 3 >= term_size.width_cells) {
                 ds_sb_append(*sb_out, "\n     ");
                 row_c = 5;
                 lines++;
@@ -434,7 +893,7 @@ size_t wrap_pages_by_words(cJSON *pages, DS_SB_StringBuffer **sb_out, size_t ini
             ds_sb_append(*sb_out, "\e\\");
             ds_sb_append(*sb_out, title);
             ds_sb_append(*sb_out, "\e]8;;\e\\\033[0m");
-            row_c += strlen(title);
+            row_c += title_w;
         }
         i++;
     }
@@ -457,7 +916,6 @@ void print_fact(Fact fact, uint8_t image_rendered, ChafaTermInfo *term_info, Ter
         printf("\033[%dG", initial_col);
 
         DS_SB_StringBuffer *word_sb = ds_sb_create();
-        size_t row_c = 0;
         size_t line_c = 3;
 
         printf("\033[90m %s %d%s, %d \033[42m\033[30m In history \033[0m\033[32m\033[0m",
@@ -468,37 +926,12 @@ void print_fact(Fact fact, uint8_t image_rendered, ChafaTermInfo *term_info, Ter
         // Move cursor two rows down
         printf("\033[2B");
         // Move cursor right
-        printf("\033[%dG", initial_col);
+        printf("\033[%dG", initial_col + 1);
+
+        line_c += wrap_text_by_words(fact, initial_col, term_size) - 1;
 
-        for (size_t i = 0; i < strlen(fact.text) + 1; i++) {
-            if (fact.text[i] == ' ' || fact.text[i] == 0) {
-                if (word_sb->size > 0) {
-                    if (initial_col + row_c + word_sb->size + 1 > term_size.width_cells) {
-                        // Move cursor to the next row
-                        printf("\033[1B");
-                        // Move cursor right
-                        printf("\033[%dG", initial_col + 1);
-                        row_c = 0;
-                        line_c++;
-                    } else {
-                        putchar(' ');
-                    }
-                    printf("%s", word_sb->data);
-                    row_c += word_sb->size + 1;
-                    ds_sb_clear(word_sb);
-                }
-            } else if (fact.text[i] != '\n') {
-                char c[2];
-                c[0] = fact.text[i];
-                c[1] = '\0';
-                ds_sb_append(word_sb, c);
-            }
-        }
         size_t spare_lines = height_cells - line_c;
         size_t pages_rc = 0;
-        row_c = 0;
-
-        ds_sb_clear(word_sb);
 
         if (cJSON_IsArray(fact.pages)) {
             pages_rc = wrap_pages_by_words(fact.pages, &word_sb, initial_col, term_size);
@@ -544,7 +977,8 @@ void print_fact(Fact fact, uint8_t image_rendered, ChafaTermInfo *term_info, Ter
                fact.day,
                number_to_ordinal(fact.day),
                fact.year);
-        printf("%s\n", fact.text);
+        wrap_text_by_words(fact, 0, term_size);
+        putchar('\n');
 
         DS_SB_StringBuffer *sb = ds_sb_create();
         if (cJSON_IsArray(fact.pages)) {
@@ -571,7 +1005,8 @@ int main(int argc, char **argv) {
         gint width_cells, height_cells;
         uint8_t image_rendered = 0;
 
-        if (options.render_image && fact.thumb && strlen(fact.thumb) > 0) {
+        // The side-by-side layout needs the precomputed words to wrap the text.
+        if (options.render_image && fact.words != NULL && fact.thumb && strlen(fact.thumb) > 0) {
             image_rendered = render_thumb(fact.thumb, term_info, options.term_size, &width_cells, &height_cells);
         }
         print_fact(fact, image_rendered, term_info, options.term_size, width_cells, height_cells);
@@ -580,6 +1015,7 @@ int main(int argc, char **argv) {
         g_strfreev(envp);
     }
     free(fact.text);
+    free(fact.words);
     free(fact.thumb);
     cJSON_Delete(fact.pages);
 